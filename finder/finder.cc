@@ -19,6 +19,7 @@ using std::string;
 using std::vector;
 using supplyfinder::Finder;
 using supplyfinder::FinderRequest;
+using supplyfinder::FinderSnapshot;
 using supplyfinder::FoodID;
 using supplyfinder::InventoryInfo;
 using supplyfinder::ShopInfo;
@@ -33,11 +34,42 @@ Status FinderServiceImpl::CheckFood(ServerContext* context,
   std::cout << "========== Receving Request Food: " << request->food_name()
             << " ==========" << std::endl;
   const opencensus::trace::Span& span = grpc::GetSpanFromServerContext(context);
+  span.AddAnnotation("Waiting for admission.");
+  Status admitted = admission_.Acquire(context, request->priority());
+  if (!admitted.ok()) {
+    std::cout << "Request rejected. " << admitted.error_code() << ": "
+              << admitted.error_message() << std::endl;
+    span.AddAnnotation("Rejected by admission control.");
+    return admitted;
+  }
+
   span.AddAnnotation("Processing request.");
-  vector<ShopInfo> result = ProcessRequest(request->food_name(), &span);
+  auto start = std::chrono::steady_clock::now();
+  vector<ShopInfo> result = ProcessRequest(request->food_name(), context, &span);
+  bool cancelled = context->IsCancelled();
+  // The context is also cancelled when the deadline passes. Those requests
+  // are the slow ones the limit has to react to, so only cancels by the
+  // client and unknown food, which makes no downstream calls, are ignored.
+  AdmissionController::Outcome outcome =
+      AdmissionController::Outcome::kCompleted;
+  if (cancelled && std::chrono::system_clock::now() >= context->deadline()) {
+    outcome = AdmissionController::Outcome::kDeadlineExceeded;
+  } else if (cancelled || GetFoodID(request->food_name()) < 0) {
+    outcome = AdmissionController::Outcome::kIgnored;
+  }
+  admission_.Release(std::chrono::steady_clock::now() - start, outcome);
   long quantity = request->quantity();
   std::cerr << "  Current context: " << span.context().ToString() << "\n";
 
+  if (outcome == AdmissionController::Outcome::kDeadlineExceeded) {
+    Status status(StatusCode::DEADLINE_EXCEEDED, "Deadline exceeded.");
+    return status;
+  }
+  if (cancelled) {
+    Status status(StatusCode::CANCELLED, "Request cancelled by the client.");
+    return status;
+  }
+
   if (result.empty()) {
     Status status(StatusCode::NOT_FOUND,
                   "Food " + request->food_name() + " not found.");
@@ -58,15 +90,23 @@ Status FinderServiceImpl::CheckFood(ServerContext* context,
 }
 
 VendorClient::VendorClient(std::shared_ptr<grpc::Channel> vendor_channel)
-    : vendor_stub_(supplyfinder::Vendor::NewStub(vendor_channel)) {}
+    : vendor_channel_(vendor_channel),
+      vendor_stub_(supplyfinder::Vendor::NewStub(vendor_channel)) {}
+
+bool VendorClient::WaitForConnected(
+    std::chrono::system_clock::time_point deadline) {
+  return vendor_channel_->WaitForConnected(deadline);
+}
 
-InventoryInfo VendorClient::InquireInventoryInfo(uint32_t food_id) {
+InventoryInfo VendorClient::InquireInventoryInfo(
+    uint32_t food_id, const ServerContext& server_context) {
   FoodID request;
   request.set_food_id(food_id);
   InventoryInfo info;
-  ClientContext context;
+  std::unique_ptr<ClientContext> context =
+      ClientContext::FromServerContext(server_context);
 
-  Status status = vendor_stub_->CheckInventory(&context, request, &info);
+  Status status = vendor_stub_->CheckInventory(context.get(), request, &info);
 
   if (status.ok()) {
     return info;
@@ -79,22 +119,157 @@ InventoryInfo VendorClient::InquireInventoryInfo(uint32_t food_id) {
 }
 
 SupplierClient::SupplierClient(std::shared_ptr<grpc::Channel> supplier_channel)
-    : supplier_stub_(supplyfinder::Supplier::NewStub(supplier_channel)) {}
+    : supplier_channel_(supplier_channel),
+      supplier_stub_(supplyfinder::Supplier::NewStub(supplier_channel)) {}
 
-std::unique_ptr<ClientReader<VendorInfo>>& SupplierClient::InitReader(
+bool SupplierClient::WaitForConnected(
+    std::chrono::system_clock::time_point deadline) {
+  return supplier_channel_->WaitForConnected(deadline);
+}
+
+std::unique_ptr<ClientReader<VendorInfo>> SupplierClient::InitReader(
     ClientContext* context_ptr, FoodID& request) {
-  // Release previous reader
-  reader_.reset();
-  // Use the context and request on stack to create new reader
-  // The context and request will be released when ProcessRequest
-  // exits
-  reader_ = supplier_stub_->CheckVendor(context_ptr, request);
-  return reader_;
+  // The context and request must outlive the reader. Both are
+  // released when ProcessRequest exits.
+  return supplier_stub_->CheckVendor(context_ptr, request);
+}
+
+AdmissionController::AdmissionController(const AdmissionOptions& options)
+    : options_(options),
+      in_flight_(0),
+      limit_(options.initial_limit),
+      short_rtt_ms_(0),
+      long_rtt_ms_(0),
+      next_seq_(0) {}
+
+bool AdmissionController::WaiterOrder::operator()(const Waiter* lhs,
+                                                  const Waiter* rhs) const {
+  // Higher priority first, then earlier deadline, then arrival order.
+  if (lhs->priority != rhs->priority) return lhs->priority > rhs->priority;
+  if (lhs->deadline != rhs->deadline) return lhs->deadline < rhs->deadline;
+  return lhs->seq < rhs->seq;
+}
+
+bool AdmissionController::CanMeetDeadline(Waiter* waiter) const {
+  // Without a deadline or a latency sample there is nothing to judge by.
+  if (waiter->deadline == std::chrono::system_clock::time_point::max() ||
+      short_rtt_ms_ <= 0) {
+    return true;
+  }
+  // Only waiters ranked before this one are served first.
+  double ahead = std::distance(queue_.begin(), queue_.lower_bound(waiter));
+  // With every slot taken, one more request has to finish before a slot
+  // frees up for the first waiter.
+  if (in_flight_ >= limit_) ahead += in_flight_ - limit_ + 1;
+  // Slots free up about every short_rtt_ms_ / limit_. Then this request
+  // takes another short_rtt_ms_.
+  double expected_ms = short_rtt_ms_ * (1 + ahead / limit_);
+  auto expected_finish =
+      std::chrono::system_clock::now() +
+      std::chrono::duration_cast<std::chrono::system_clock::duration>(
+          std::chrono::duration<double, std::milli>(expected_ms));
+  return expected_finish <= waiter->deadline;
+}
+
+Status AdmissionController::Acquire(ServerContext* context,
+                                    uint32_t priority) {
+  std::unique_lock<std::mutex> lock(mu_);
+  Waiter self = {priority, context->deadline(), next_seq_++, false};
+  // A free slot is always taken, even if the latency estimate says the
+  // deadline will be missed. short_rtt_ms_ is only updated by admitted
+  // requests, so rejecting here could keep a stale estimate forever.
+  if (queue_.empty() && in_flight_ < limit_) {
+    ++in_flight_;
+    return Status::OK;
+  }
+  if (!CanMeetDeadline(&self)) {
+    return Status(StatusCode::RESOURCE_EXHAUSTED,
+                  "Finder overloaded: request cannot meet its deadline.");
+  }
+  if (queue_.size() >= options_.max_queue) {
+    // Make room by shedding the lowest ranked waiter, if this request
+    // outranks it.
+    auto last = std::prev(queue_.end());
+    if (!WaiterOrder()(&self, *last)) {
+      return Status(StatusCode::RESOURCE_EXHAUSTED,
+                    "Finder overloaded: admission queue is full.");
+    }
+    (*last)->shed = true;
+    queue_.erase(last);
+    cv_.notify_all();
+  }
+  queue_.insert(&self);
+
+  while (true) {
+    if (self.shed) {
+      return Status(StatusCode::RESOURCE_EXHAUSTED,
+                    "Finder overloaded: request shed for higher priority.");
+    }
+    if (*queue_.begin() == &self && in_flight_ < limit_) {
+      queue_.erase(queue_.begin());
+      ++in_flight_;
+      // The next waiter may fit under the limit as well.
+      cv_.notify_all();
+      return Status::OK;
+    }
+    if (context->IsCancelled()) {
+      queue_.erase(&self);
+      cv_.notify_all();
+      return Status(StatusCode::CANCELLED, "Request cancelled while queued.");
+    }
+    if (!CanMeetDeadline(&self)) {
+      queue_.erase(&self);
+      cv_.notify_all();
+      return Status(StatusCode::RESOURCE_EXHAUSTED,
+                    "Finder overloaded: request cannot meet its deadline.");
+    }
+    // Cancellation is not signalled through cv_, so wake up periodically.
+    cv_.wait_for(lock, std::chrono::milliseconds(50));
+  }
 }
 
-FinderServiceImpl::FinderServiceImpl(const std::string& supplier_target_str)
+void AdmissionController::Release(std::chrono::steady_clock::duration latency,
+                                  Outcome outcome) {
+  std::lock_guard<std::mutex> lock(mu_);
+  if (outcome != Outcome::kIgnored) {
+    UpdateLimit(
+        std::chrono::duration<double, std::milli>(latency).count());
+  }
+  if (outcome == Outcome::kDeadlineExceeded) {
+    limit_ = std::max(options_.min_limit, limit_ * options_.backoff_ratio);
+  }
+  --in_flight_;
+  cv_.notify_all();
+}
+
+void AdmissionController::UpdateLimit(double latency_ms) {
+  if (short_rtt_ms_ <= 0) {
+    short_rtt_ms_ = long_rtt_ms_ = latency_ms;
+    return;
+  }
+  short_rtt_ms_ += options_.short_alpha * (latency_ms - short_rtt_ms_);
+  long_rtt_ms_ += options_.long_alpha * (latency_ms - long_rtt_ms_);
+  // Don't grow the limit while it isn't being used.
+  if (in_flight_ < limit_ / 2) return;
+  // Latency above the long term average means requests are queueing up
+  // downstream; shrink the limit by at most half. The square root term
+  // leaves room to probe for more capacity.
+  double gradient =
+      std::max(0.5, std::min(1.0, long_rtt_ms_ / short_rtt_ms_));
+  double new_limit = limit_ * gradient + std::sqrt(limit_);
+  limit_ = limit_ * (1 - options_.smoothing) + new_limit * options_.smoothing;
+  limit_ = std::max(options_.min_limit, std::min(options_.max_limit, limit_));
+}
+
+FinderServiceImpl::FinderServiceImpl(const std::string& supplier_target_str,
+                                     const std::string& snapshot_path)
     : supplier_client_(grpc::CreateChannel(
-          supplier_target_str, grpc::InsecureChannelCredentials())) {
+          supplier_target_str, grpc::InsecureChannelCredentials())),
+      admission_(AdmissionOptions()),
+      snapshot_dirty_(false),
+      stopping_(false),
+      snapshot_path_(snapshot_path),
+      snapshot_thread_(&FinderServiceImpl::SnapshotLoop, this) {
   std::cout << "Registered " << supplier_target_str << " as the supplier."
             << std::endl;
   vector<string> food_names = {"apple",  "egg",    "milk",    "flour", "water",
@@ -102,6 +277,170 @@ FinderServiceImpl::FinderServiceImpl(const std::string& supplier_target_str)
   InitFoodID(food_names);
 }
 
+FinderServiceImpl::~FinderServiceImpl() {
+  {
+    std::lock_guard<std::mutex> lock(vendor_mu_);
+    stopping_ = true;
+  }
+  snapshot_cv_.notify_one();
+  snapshot_thread_.join();
+}
+
+void FinderServiceImpl::WarmUp(std::chrono::milliseconds timeout) {
+  auto deadline = std::chrono::system_clock::now() + timeout;
+  FinderSnapshot snapshot;
+  std::ifstream input(snapshot_path_, std::ios::binary);
+  if (!input) {
+    std::cout << "No snapshot at " << snapshot_path_ << "." << std::endl;
+  } else if (!snapshot.ParseFromIstream(&input)) {
+    std::cout << "Cannot parse snapshot " << snapshot_path_ << "."
+              << std::endl;
+    snapshot.Clear();
+  }
+
+  // The supplier is the source of truth for vendor urls, so the vendor set
+  // can be rebuilt even without a snapshot.
+  vector<VendorInfo> listed;
+  bool listed_all = ListVendors(deadline, &listed);
+  std::unordered_set<string> listed_urls;
+  for (const VendorInfo& info : listed) listed_urls.insert(info.url());
+
+  vector<VendorClient*> clients;
+  vector<string> urls;
+  int dropped = 0;
+  {
+    std::lock_guard<std::mutex> lock(vendor_mu_);
+    for (const VendorInfo& info : snapshot.vendors()) {
+      // Only drop a vendor when a complete listing from the supplier no
+      // longer has it. A vendor that is slow to connect is kept.
+      if (listed_all && !listed_urls.count(info.url())) {
+        dropped++;
+        std::cout << "Vendor at " << info.url()
+                  << " no longer listed by the supplier. Dropping it."
+                  << std::endl;
+        continue;
+      }
+      AddVendorLocked(info);
+    }
+    for (const VendorInfo& info : listed) AddVendorLocked(info);
+    for (auto& client : vendor_clients_) {
+      urls.push_back(client.first);
+      clients.push_back(&client.second);
+    }
+  }
+
+  // WaitForConnected blocks, so connect every channel on its own thread.
+  // A slot is written by a single thread only.
+  bool supplier_connected = false;
+  vector<char> vendor_connected(clients.size(), false);
+  vector<std::thread> threads;
+  threads.emplace_back([this, deadline, &supplier_connected] {
+    supplier_connected = supplier_client_.WaitForConnected(deadline);
+  });
+  for (size_t i = 0; i < clients.size(); i++) {
+    threads.emplace_back([&clients, &vendor_connected, deadline, i] {
+      vendor_connected[i] = clients[i]->WaitForConnected(deadline);
+    });
+  }
+  for (auto& thread : threads) thread.join();
+
+  if (!supplier_connected) {
+    std::cout << "Supplier not connected during warm up." << std::endl;
+  }
+  int connected = 0;
+  for (size_t i = 0; i < clients.size(); i++) {
+    if (vendor_connected[i]) {
+      connected++;
+    } else {
+      std::cout << "Vendor at " << urls[i]
+                << " not connected during warm up. Keeping it." << std::endl;
+    }
+  }
+
+  // Write the warmed up vendor set once.
+  {
+    std::lock_guard<std::mutex> lock(vendor_mu_);
+    snapshot_dirty_ = true;
+  }
+  snapshot_cv_.notify_one();
+  std::cout << "Warm up done. Connected " << connected << " of "
+            << clients.size() << " known vendors, dropped " << dropped
+            << "." << std::endl;
+}
+
+bool FinderServiceImpl::ListVendors(
+    std::chrono::system_clock::time_point deadline,
+    vector<VendorInfo>* vendors) {
+  bool complete = true;
+  for (const auto& food : food_id_) {
+    ClientContext context;
+    context.set_deadline(deadline);
+    FoodID request;
+    request.set_food_id(food.second);
+    std::unique_ptr<ClientReader<VendorInfo>> reader =
+        supplier_client_.InitReader(&context, request);
+    VendorInfo info;
+    while (reader->Read(&info)) vendors->push_back(info);
+    Status status = reader->Finish();
+    // NOT_FOUND means no vendor has the food yet.
+    if (!status.ok() && status.error_code() != StatusCode::NOT_FOUND) {
+      std::cout << "Cannot list vendors for " << food.first << ". "
+                << status.error_code() << ": " << status.error_message()
+                << std::endl;
+      complete = false;
+    }
+  }
+  return complete;
+}
+
+bool FinderServiceImpl::AddVendorLocked(const VendorInfo& info) {
+  const string& url = info.url();
+  if (vendor_clients_.count(url)) return false;
+  vendor_clients_.emplace(
+      url, VendorClient(grpc::CreateChannel(
+               url, grpc::InsecureChannelCredentials())));
+  *snapshot_.add_vendors() = info;
+  return true;
+}
+
+VendorClient* FinderServiceImpl::GetVendorClient(const VendorInfo& info,
+                                                 bool* created) {
+  std::lock_guard<std::mutex> lock(vendor_mu_);
+  *created = AddVendorLocked(info);
+  if (*created) {
+    snapshot_dirty_ = true;
+    snapshot_cv_.notify_one();
+  }
+  return &vendor_clients_.find(info.url())->second;
+}
+
+void FinderServiceImpl::SnapshotLoop() {
+  std::unique_lock<std::mutex> lock(vendor_mu_);
+  while (true) {
+    snapshot_cv_.wait(lock, [this] { return snapshot_dirty_ || stopping_; });
+    // Pending changes are written before stopping.
+    if (!snapshot_dirty_) return;
+    FinderSnapshot snapshot = snapshot_;
+    snapshot_dirty_ = false;
+    lock.unlock();
+    WriteSnapshot(snapshot);
+    lock.lock();
+  }
+}
+
+void FinderServiceImpl::WriteSnapshot(const FinderSnapshot& snapshot) {
+  // Write to a temporary file and rename it, so that a crash never
+  // leaves a truncated snapshot behind.
+  string tmp_path = snapshot_path_ + ".tmp";
+  std::ofstream output(tmp_path, std::ios::binary | std::ios::trunc);
+  bool ok = output && snapshot.SerializeToOstream(&output);
+  output.close();
+  if (!ok || !output ||
+      std::rename(tmp_path.c_str(), snapshot_path_.c_str()) != 0) {
+    std::cout << "Cannot write snapshot " << snapshot_path_ << std::endl;
+  }
+}
+
 void FinderServiceImpl::PrintVendorInfo(const uint32_t id,
                                         const VendorInfo& info) {
   std::cout << "This vendor might have food " << id << std::endl;
@@ -130,7 +469,8 @@ void FinderServiceImpl::InitFoodID(vector<string>& food_names) {
 }
 
 vector<ShopInfo> FinderServiceImpl::ProcessRequest(
-    const string& food_name, const opencensus::trace::Span* parent) {
+    const string& food_name, ServerContext* server_context,
+    const opencensus::trace::Span* parent) {
   /*
    * Initiate client with supplier channel. Retrieve a list of vendor address
    * Then create client
@@ -138,7 +478,9 @@ vector<ShopInfo> FinderServiceImpl::ProcessRequest(
    */
   vector<ShopInfo> result;
   VendorInfo vendor_info;
-  ClientContext context;
+  // Propagates the client's deadline and cancellation to the supplier.
+  std::unique_ptr<ClientContext> context =
+      ClientContext::FromServerContext(*server_context);
   FoodID request;
   auto span =
       opencensus::trace::Span::StartSpan("Querying information", parent);
@@ -150,22 +492,25 @@ vector<ShopInfo> FinderServiceImpl::ProcessRequest(
     return result;
   }
   request.set_food_id(food_id);
-  std::unique_ptr<ClientReader<VendorInfo>>& reader =
-      supplier_client_.InitReader(&context, request);
+  std::unique_ptr<ClientReader<VendorInfo>> reader =
+      supplier_client_.InitReader(context.get(), request);
 
   while (reader->Read(&vendor_info)) {
-    // if never connected before, create a new client.
+    // The client is gone, stop fanning out to vendors.
+    if (server_context->IsCancelled()) {
+      span.AddAnnotation("Request cancelled. Stop querying vendors.");
+      context->TryCancel();
+      break;
+    }
+    // if never connected before, create a new client. The vendor is
+    // remembered for the next start.
     FinderServiceImpl::PrintVendorInfo(food_id, vendor_info);
     const string& url = vendor_info.url();
-    auto client = vendor_clients_.find(url);
-    if (client == vendor_clients_.end()) {
-      auto element = vendor_clients_.emplace(
-          url, VendorClient(grpc::CreateChannel(
-                   url, grpc::InsecureChannelCredentials())));
-      client = element.first;  // assign the newly created client iterator
-    }
+    bool created;
+    VendorClient* client = GetVendorClient(vendor_info, &created);
 
-    InventoryInfo inventory_info = client->second.InquireInventoryInfo(food_id);
+    InventoryInfo inventory_info =
+        client->InquireInventoryInfo(food_id, *server_context);
     // error checking: if no inventory, price == -1
     if (inventory_info.price() < 0)
       std::cout << "vendor at " << url << " doesn't have food " << food_id
@@ -188,10 +533,15 @@ vector<ShopInfo> FinderServiceImpl::ProcessRequest(
   return result;
 }
 
-void RunServer(string& supplier_target_str) {
+void RunServer(string& supplier_target_str, string& snapshot_path,
+               std::chrono::milliseconds warm_up_timeout) {
   std::string server_address("0.0.0.0:50051");
-  FinderServiceImpl service(supplier_target_str);
+  FinderServiceImpl service(supplier_target_str, snapshot_path);
+  // Connect the channels before the port opens, so that the health check
+  // only reports SERVING once the Finder is warm.
+  service.WarmUp(warm_up_timeout);
 
+  grpc::EnableDefaultHealthCheckService(true);
   ServerBuilder builder;
 
   builder.AddListeningPort(server_address, grpc::InsecureServerCredentials());
@@ -202,18 +552,61 @@ void RunServer(string& supplier_target_str) {
   std::unique_ptr<Server> server(builder.BuildAndStart());
   std::cout << "Server listening on " << server_address << std::endl;
 
+  // SIGTERM and SIGINT are blocked in every thread (see main) and handled
+  // here, so that the server shuts down and the service is destroyed.
+  std::thread signal_thread([&server] {
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGINT);
+    int received;
+    sigwait(&signals, &received);
+    std::cout << "Received signal " << received << ". Shutting down."
+              << std::endl;
+    server->Shutdown(std::chrono::system_clock::now() +
+                     std::chrono::seconds(5));
+  });
+
   server->Wait();
+  signal_thread.join();
 }
 
 int main(int argc, char** argv) {
-  // The Finder takes the argument -s to get the address of the supplier.
+  // Block the shutdown signals before any thread is created, so that every
+  // thread inherits the mask and only RunServer receives them.
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGTERM);
+  sigaddset(&signals, SIGINT);
+  pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+  // The Finder takes the argument -s to get the address of the supplier,
+  // -w to get the path of the warm start snapshot, and -t to get the
+  // maximum warm up time in milliseconds.
   std::string supplier_target_str = "0.0.0.0:50052";
+  std::string snapshot_path = "finder_snapshot.pb";
+  std::chrono::milliseconds warm_up_timeout(5000);
   int c;
-  while ((c = getopt(argc, argv, "s:")) != -1) {
+  while ((c = getopt(argc, argv, "s:w:t:")) != -1) {
     switch (c) {
       case 's':
         if (optarg) supplier_target_str = optarg;
         break;
+      case 'w':
+        if (optarg) snapshot_path = optarg;
+        break;
+      case 't':
+        if (optarg) {
+          char* end;
+          long timeout_ms = strtol(optarg, &end, 10);
+          if (*end != '\0' || timeout_ms <= 0) {
+            std::cerr << "Warm up time must be a positive number of "
+                      << "milliseconds, got " << optarg << std::endl;
+            return 1;
+          }
+          warm_up_timeout = std::chrono::milliseconds(timeout_ms);
+        }
+        break;
     }
   }
   grpc::RegisterOpenCensusPlugin();
@@ -221,7 +614,7 @@ int main(int argc, char** argv) {
   RegisterExporters();
   opencensus::trace::TraceConfig::SetCurrentTraceParams(
       {128, 128, 128, 128, opencensus::trace::ProbabilitySampler(1.0)});
-  RunServer(supplier_target_str);
+  RunServer(supplier_target_str, snapshot_path, warm_up_timeout);
 
   return 0;
 }
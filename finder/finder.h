@@ -1,18 +1,30 @@
 // #include <grpcpp/ext/proto_server_reflection_plugin.h>
 
 #include <grpcpp/grpcpp.h>
+#include <signal.h>
 #include <unistd.h>
 
 #include <algorithm>
 #include <cctype>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
 #include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
 #include <iostream>
+#include <iterator>
 #include <memory>
+#include <mutex>
+#include <set>
 #include <string>
+#include <thread>
 #include <unordered_map>
+#include <unordered_set>
 #include <utility>
 #include <vector>
-// #include <grpcpp/health_check_service_interface.h>
+#include <grpcpp/health_check_service_interface.h>
 #include <grpcpp/opencensus.h>
 
 #include "absl/strings/escaping.h"
@@ -49,9 +61,14 @@ class VendorClient {
    */
  public:
   VendorClient(std::shared_ptr<grpc::Channel> vendor_channel);
-  supplyfinder::InventoryInfo InquireInventoryInfo(uint32_t food_id);
+  // The call inherits the deadline and cancellation of server_context.
+  supplyfinder::InventoryInfo InquireInventoryInfo(
+      uint32_t food_id, const grpc::ServerContext& server_context);
+  // Connect the channel. Return false if not connected by the deadline.
+  bool WaitForConnected(std::chrono::system_clock::time_point deadline);
 
  private:
+  std::shared_ptr<grpc::Channel> vendor_channel_;
   std::unique_ptr<supplyfinder::Vendor::Stub> vendor_stub_;
 };
 
@@ -62,12 +79,90 @@ class SupplierClient {
  public:
   SupplierClient(std::shared_ptr<grpc::Channel> supplier_channel);
   bool GetVendorInfo(supplyfinder::VendorInfo* vendor_info);
-  std::unique_ptr<grpc::ClientReader<supplyfinder::VendorInfo>>& InitReader(
+  // The reader is owned by the caller so that concurrent requests
+  // don't share a stream.
+  std::unique_ptr<grpc::ClientReader<supplyfinder::VendorInfo>> InitReader(
       grpc::ClientContext* context_ptr, supplyfinder::FoodID& request);
+  // Connect the channel. Return false if not connected by the deadline.
+  bool WaitForConnected(std::chrono::system_clock::time_point deadline);
 
  private:
+  std::shared_ptr<grpc::Channel> supplier_channel_;
   std::unique_ptr<supplyfinder::Supplier::Stub> supplier_stub_;
-  std::unique_ptr<grpc::ClientReader<supplyfinder::VendorInfo>> reader_;
+};
+
+struct AdmissionOptions {
+  // Bounds and starting point of the adaptive concurrency limit.
+  double initial_limit = 20;
+  double min_limit = 4;
+  double max_limit = 200;
+  // Maximum number of requests waiting for a slot.
+  size_t max_queue = 50;
+  // Weights of a new latency sample in the short and long term averages.
+  double short_alpha = 0.2;
+  double long_alpha = 0.01;
+  // Weight of a new limit estimate when updating the limit.
+  double smoothing = 0.2;
+  // Factor the limit is multiplied by when a request misses its deadline.
+  double backoff_ratio = 0.9;
+};
+
+class AdmissionController {
+  /*
+   * AdmissionController sits in front of CheckFood. Requests wait in a
+   * bounded queue ordered by priority, then deadline. Requests that cannot
+   * finish before their deadline are rejected up front. The number of
+   * requests running at once follows a gradient limit: it shrinks when the
+   * recent latency rises above the long term latency and grows otherwise.
+   */
+ public:
+  // How a request admitted by Acquire ended.
+  enum class Outcome {
+    // Completed, its latency is a sample for the limit.
+    kCompleted,
+    // Missed its deadline. Its latency is a sample and the limit backs off.
+    kDeadlineExceeded,
+    // Cancelled by the client or made no downstream calls. Its latency
+    // says nothing about the load.
+    kIgnored,
+  };
+
+  AdmissionController(const AdmissionOptions& options);
+  // Block until the request may run. Return OK once a slot is taken,
+  // otherwise the status the request should be rejected with.
+  grpc::Status Acquire(grpc::ServerContext* context, uint32_t priority);
+  // Give back the slot taken by Acquire.
+  void Release(std::chrono::steady_clock::duration latency, Outcome outcome);
+
+ private:
+  struct Waiter {
+    uint32_t priority;
+    std::chrono::system_clock::time_point deadline;
+    uint64_t seq;
+    // Set when a request with a higher priority takes its place in the queue.
+    bool shed;
+  };
+  struct WaiterOrder {
+    bool operator()(const Waiter* lhs, const Waiter* rhs) const;
+  };
+
+  // Whether the waiter is expected to finish before its deadline, counting
+  // the queued requests that outrank it and the requests holding the
+  // slots. The waiter doesn't need to be in the queue. Must hold mu_.
+  bool CanMeetDeadline(Waiter* waiter) const;
+  // Must hold mu_.
+  void UpdateLimit(double latency_ms);
+
+  const AdmissionOptions options_;
+  std::mutex mu_;
+  std::condition_variable cv_;
+  std::set<Waiter*, WaiterOrder> queue_;
+  uint32_t in_flight_;
+  double limit_;
+  // Latency averages in milliseconds, zero until the first sample.
+  double short_rtt_ms_;
+  double long_rtt_ms_;
+  uint64_t next_seq_;
 };
 
 class FinderServiceImpl final : public supplyfinder::Finder::Service {
@@ -78,28 +173,68 @@ class FinderServiceImpl final : public supplyfinder::Finder::Service {
    * information
    */
  public:
-  FinderServiceImpl(const std::string& supplier_target_str);
+  // Vendors seen by the Finder are persisted to snapshot_path by a
+  // background thread.
+  FinderServiceImpl(const std::string& supplier_target_str,
+                    const std::string& snapshot_path);
+  // Write out pending snapshot changes, then stop the background thread.
+  ~FinderServiceImpl();
+  // Load the vendors from the last snapshot and the supplier, then connect
+  // the supplier and all vendor channels in parallel, waiting at most
+  // `timeout`. Vendors are only dropped when the supplier no longer lists
+  // them.
+  void WarmUp(std::chrono::milliseconds timeout);
   // Receive gRPC request and use the corresponding food id 
   // to query supplier and vendors.
   // Reture a minimum satisfying list of shop info and food info.
+  // Requests go through admission control first and are rejected with
+  // RESOURCE_EXHAUSTED when the Finder is overloaded.
   grpc::Status CheckFood(grpc::ServerContext* context,
                          const supplyfinder::FinderRequest* request,
                          supplyfinder::ShopResponse* response);
   // Get corresponding food ID given food name
   long GetFoodID(const std::string& food_name);
   // Given the food name, return a full list of shop info.
-  // Part of the CheckFood Span.
+  // Part of the CheckFood Span. Downstream calls are cancelled
+  // together with the server context.
   std::vector<supplyfinder::ShopInfo> ProcessRequest(const std::string& food_name,
+                                                     grpc::ServerContext* context,
                                                      const opencensus::trace::Span* parent);
 
  private:
   // Helper functions
   static void PrintVendorInfo(const uint32_t id, const supplyfinder::VendorInfo& info);
   void InitFoodID(std::vector<std::string>& food_names);
+  // Return the client for the vendor. If never seen before, create it,
+  // mark the snapshot dirty and set *created to true.
+  VendorClient* GetVendorClient(const supplyfinder::VendorInfo& info,
+                                bool* created);
+  // Add the vendor to vendor_clients_ and snapshot_ if never seen before,
+  // without marking the snapshot dirty. Must hold vendor_mu_.
+  bool AddVendorLocked(const supplyfinder::VendorInfo& info);
+  // Append the vendors the supplier lists for every food to *vendors.
+  // Return false if any listing failed, so *vendors may be incomplete.
+  bool ListVendors(std::chrono::system_clock::time_point deadline,
+                   std::vector<supplyfinder::VendorInfo>* vendors);
+  // Runs on snapshot_thread_. Writes snapshot_ whenever it is dirty.
+  void SnapshotLoop();
+  void WriteSnapshot(const supplyfinder::FinderSnapshot& snapshot);
 
   SupplierClient supplier_client_;
+  AdmissionController admission_;
+  // guards vendor_clients_, snapshot_, snapshot_dirty_ and stopping_
+  std::mutex vendor_mu_;
   // maps server address to the client instance
   std::unordered_map<std::string, VendorClient> vendor_clients_;
+  // vendors known to the Finder, in the order they were seen
+  supplyfinder::FinderSnapshot snapshot_;
+  // whether snapshot_ changed since it was last written
+  bool snapshot_dirty_;
+  bool stopping_;
+  std::condition_variable snapshot_cv_;
+  std::string snapshot_path_;
+  // started last, once everything it uses is initialized
+  std::thread snapshot_thread_;
   // maps food name to food id
   std::unordered_map<std::string, uint32_t> food_id_;
 };